@@ -0,0 +1,72 @@
+#!/bin/bash
+# Check that tpwl copes with deep directories and that its run time grows
+# linearly with the number of path components.
+#
+# usage: tests/scaling.sh [path/to/tpwl]
+# Without an argument, tpwl.c is built into a scratch directory first.
+
+set -u
+cd "$(dirname "$0")/.." || exit 1
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+if [ $# -gt 0 ]; then
+    tpwl=$1
+else
+    tpwl=$tmp/tpwl
+    ${CC:-cc} -O2 -Wall -Wextra -Werror tpwl.c -o "$tpwl" || exit 1
+fi
+
+failed=0
+fail () { echo "FAIL: $*"; failed=1; }
+
+# A path of N components named PREFIX1, PREFIX2...
+path () { local i; for ((i = 1; i <= $1; ++i)); do printf '/%s%d' "$2" "$i"; done; }
+
+# How many different components named PREFIXnnn show up in tpwl's output
+shown () { grep -o "$1[0-9]\+" | sort -u | wc -l; }
+
+# A 4096-byte $PWD, every component of which is asked for
+pwd4k=$(path 1000 d)
+pwd4k=${pwd4k:0:4096}
+pwd4k=${pwd4k%/*}
+n=$(tr -cd / <<< "$pwd4k" | wc -c)
+got=$(PWD=$pwd4k "$tpwl" --depth="$n" --pwd | shown d)
+[ "$got" -eq "$n" ] || fail "4096-byte PWD: $got of $n components shown"
+
+# --depth well beyond the old 64-segment limit
+for depth in 65 100 500; do
+    got=$("$tpwl" --depth="$depth" --pwd="$(path 1000 d)" | shown d)
+    [ "$got" -eq "$depth" ] || fail "--depth=$depth: $got components shown"
+done
+
+# Best time in microseconds of 3 lots of 5 runs on an N-component path,
+# fails if tpwl does
+timeit () {
+    local p best= t start run i
+    p=$(path "$1" a)
+    for run in 1 2 3; do
+        start=${EPOCHREALTIME/[.,]/}
+        for i in 1 2 3 4 5; do
+            "$tpwl" --depth="$1" --pwd="$p" > /dev/null || return 1
+        done
+        t=$(( ${EPOCHREALTIME/[.,]/} - start ))
+        [ -z "$best" ] || [ "$t" -lt "$best" ] && best=$t
+    done
+    echo "$best"
+}
+
+# --depth goes before --pwd, as tpwl acts on its arguments in order.
+# Each step has 4x the components.  Linear growth is at most 4x the time
+# (less, as start-up cost is fixed); quadratic would be 16x.  Allow 8x.
+prev=
+for n in 1000 4000 16000; do
+    t=$(timeit "$n") || { fail "$n components: tpwl failed"; break; }
+    echo "$n components: ${t}us"
+    [ -n "$prev" ] && [ "$t" -gt $((prev * 8)) ] && fail "time grew ${t}us / ${prev}us from $((n / 4)) to $n components"
+    prev=$t
+done
+
+[ "$failed" -eq 0 ] && echo "PASS"
+exit "$failed"
@@ -34,13 +34,20 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static void fatal (const char *fmt_str, ...) __attribute__ ((noreturn, format (printf, 1, 2)));
 static const char TPWL_VERSION [] = "0.5";
 
 /* By default, we say that bash/readline do NOT work properly with UTF-8.
    In that case we use some horrible bodgery to try to fix this - see
-   strcpy_with_utf8_encoding () below.  */
+   emit_text () below.  */
 #ifdef __APPLE__
 static int bash_handles_utf8_p = 1;     /* Mac bash/readline groks UTF-8 */
 #else
@@ -48,6 +55,11 @@ static int bash_handles_utf8_p = 0;     /* Everything else doesn't seem to  */
 #endif
 static int spaced_p = 1;                /* Add extra spaces around certain items  */
 
+/* What the terminal can do - see term_detect ().  Unless we learn otherwise,
+   assume an xterm-256color-alike.  */
+static int term_colors = 256;           /* 256, 16, 8 or 0 (no colors at all)  */
+static unsigned term_faces = ~0u;       /* Mask of usable FACE_* bits  */
+
 /* These are the encodings for the various symbols we use in the prompts.  */
 struct symbol_info_t {
     const char lock [4], network [4], sep [4], thin [4], ellipsis [4];
@@ -84,12 +96,18 @@ static const struct symbol_info_t info_symbols [] = {
     CI_INDEX (CMD_PASSED_FG,    255,    XTERM_GRAY93)           \
     CI_INDEX (CMD_PASSED_BG,    240,    XTERM_GRAY35)           \
     CI_INDEX (CMD_FAILED_FG,    15,     XTERM_WHITE)            \
-    CI_INDEX (CMD_FAILED_BG,    161,    XTERM_DEEPPINK3)
+    CI_INDEX (CMD_FAILED_BG,    161,    XTERM_DEEPPINK3)        \
+    CI_INDEX (KUBE_FG,          255,    XTERM_GRAY93)           \
+    CI_INDEX (KUBE_BG,          26,     XTERM_DODGERBLUE3)      \
+    CI_INDEX (CONTAINER_FG,     255,    XTERM_GRAY93)           \
+    CI_INDEX (CONTAINER_BG,     90,     XTERM_DARKMAGENTA)      \
+    CI_INDEX (PROJECT_FG,       255,    XTERM_GRAY93)           \
+    CI_INDEX (PROJECT_BG,       22,     XTERM_DARKGREEN)
 
 enum color_indices {
     CI_NONE,
 #define CI_INDEX(NAME, VAL, XTERMNAME)   NAME,
-    TPWL_COLOR_INDICES          /* Expands to list all of USERNAME_FG ... CWD_FAILED_BG  */
+    TPWL_COLOR_INDICES          /* Expands to list all of USERNAME_FG ... PROJECT_BG  */
 
     N_COLOR_INDICES
 };
@@ -97,7 +115,7 @@ static uint8_t ctab [N_COLOR_INDICES] = {
     [CI_NONE] = 0,              // XTERM_BLACK
 #undef CI_INDEX
 #define CI_INDEX(NAME, VAL, XTERMNAME)   [NAME] = VAL,
-    TPWL_COLOR_INDICES          /* Expands to [USERNAME_FG] = 240, ... [CWD_FAILED_BG] = 161  */
+    TPWL_COLOR_INDICES          /* Expands to [USERNAME_FG] = 240, ... [PROJECT_BG] = 22  */
 };
 /* We dump to stderr to avoid confusion if someone does PS1=$(tpwl ... --dump-theme)  */
 void dump_themestr (void)
@@ -114,9 +132,9 @@ void dump_themestr (void)
     fprintf (stderr, "%16s  %3d  %26s \x1b[48;5;%dm        \x1b[0m\n", #NAME, ctab [NAME], (VAL == ctab [NAME]) ? #XTERMNAME : "", ctab [NAME]);
     TPWL_COLOR_INDICES
 }
-/* Allow theme to be overridden.  For now, a dumb string with all 18
+/* Allow theme to be overridden.  For now, a dumb string with all 24
    individual ctab elements, like so:
-     "250:240:124:250:238:15:31:254:32:255:250:254:166:251:255:240:15:161"
+     "250:240:124:250:238:15:31:254:32:255:250:254:166:251:255:240:15:161:255:26:255:90:255:22"
    Individual items can be skipped, eg ":::14" will set the 4th entry to 14.  */
 int load_theme (const char *str)
 {
@@ -145,28 +163,53 @@ int load_theme (const char *str)
 #define CTAB_EXPLICIT_INDEX_MASK 0x100          /* Value is explicit xterm index, not a ctab [] index.  */
 
 static int xctab (int code) { return (code & CTAB_EXPLICIT_INDEX_MASK) ? code & 0xFF : ctab [code & 0xFF]; }
-static void append_fgcolor (char *b, int code) { sprintf (b + strlen (b), "\\e[38;5;%dm", xctab (code)); }
-static void append_bgcolor (char *b, int code) { sprintf (b + strlen (b), "\\e[48;5;%dm", xctab (code)); }
-static char             pline [8192];           /* "Big enough" (ahem) to avoid checks  */
 static enum symtype_t   symtyp = SYM_PATCHED;   /* Assume patched fonts available - use --compat otherwise  */
 
+/* Non-owning view of LEN bytes at STR - not necessarily NUL-terminated.
+   Segment text points straight into argv, the environment or our constant
+   tables; nothing is copied until the prompt is written out.  */
+struct strview_t {
+    const char  *str;
+    size_t      len;
+};
+static struct strview_t strview (const char *str) { struct strview_t v = {str, strlen (str)}; return v; }
+
+static inline int strbegins_p (const char *str, const char *start)
+{
+    return (strncmp (str, start, strlen (start)) == 0);
+}
+
 #define FACE_ITALIC 1
 #define FACE_NORMAL 0
-#define MAXSEGS     64
+#define SEG_MAXPARTS 4                          /* eg  ELLIPSIS SPACE DIRNAME SPACE  */
 struct segment_t {                              /* Individual segment ("chunk") of bash prompt  */
     uint16_t    fgcolor, bgcolor;
     uint16_t    sep_fg;
     uint8_t     fontface;                       /* FONT_ITALIC for now  */
-    char        sep [4];                        /* Must NOT be truncated */
-    char        item [128 - (6 + 4 + 1)];       /* Could be truncated  */ 
+    uint8_t     nparts;
+    const char  *sep;                           /* Always one of info_symbols [] or ""  */
+    struct strview_t parts [SEG_MAXPARTS];      /* Item text, drawn in order  */
 };
 static struct segs {
-    struct segment_t segs [MAXSEGS];
-    unsigned nsegs;
+    struct segment_t *segs;                     /* Grows as required  */
+    size_t      nsegs, maxsegs;
 } pwl_segs;                                     /* All Powerline segments  */
 
-//static const char sitm [] = "\x1b[3m", ritm [] = "\x1b[0m";
-static void append_fontface (char *b, unsigned fontface) { sprintf (b + strlen (b), "\\e[%dm", (fontface) ? 3 :0); }
+/* Ensure the array at P (currently room for *MAXP elements of ELSIZE bytes)
+   can hold at least N elements, doubling as required so that appending is
+   amortised constant time.  Returns the (possibly moved) array.  */
+static void *grow_array (void *p, size_t *maxp, size_t n, size_t elsize)
+{
+    if (n <= *maxp)
+        return p;
+    size_t newmax = (*maxp) ? *maxp * 2 : 16;
+    while (newmax < n)
+        newmax *= 2;
+    if ((p = realloc (p, newmax * elsize)) == NULL)
+        fatal ("tpwl: out of memory\n");
+    *maxp = newmax;
+    return p;
+}
 
 /* Returns the length of the UTF-8 character encoded at STR.
    Only one UTF-8 character beginning at STR is examined.
@@ -183,6 +226,11 @@ static int get_char_len_utf8 (const char *str)
 
     const unsigned nc = * (uint8_t *) (str + 1);
 
+    /* NC, the second char, MUST always be 0x80 .. 0xBF - checking it first
+       also means we never look past a terminating null.  */
+    if (nc < 0x80 || nc > 0xBF)
+        return 1;               /* Nope: just say we're ASCII  */
+
     if (fc >= 0xC2 && fc <= 0xDF && nc >= 0x80 && nc <= 0xBF)
         return 2;
 
@@ -222,68 +270,165 @@ static int get_char_len_utf8 (const char *str)
     return 1;
 }                                           /* get_char_len_utf8 ()  */
 
+/* The prompt is written straight to an output stream.  Anything bash
+   shouldn't count towards the prompt width must be inside \[ ... \] - we
+   keep track of whether such a sequence is open so that adjacent
+   nonprintables share one pair of brackets.  */
+struct emitter_t {
+    FILE        *fp;
+    int         nonprint_p;             /* Inside an (unclosed) \[ sequence  */
+};
+
+static void emit_nonprint (struct emitter_t *e, const char *str, size_t len)
+{
+    if (! e->nonprint_p)
+    {
+        fputs ("\\[", e->fp);           /* Bash begin sequence of nonprinting characters  */
+        e->nonprint_p = 1;
+    }
+    fwrite (str, 1, len, e->fp);
+}
+static void emit_print (struct emitter_t *e, const char *str, size_t len)
+{
+    if (len == 0)
+        return;
+    if (e->nonprint_p)
+    {
+        fputs ("\\]", e->fp);           /* Bash end sequence of nonprinting characters  */
+        e->nonprint_p = 0;
+    }
+    fwrite (str, 1, len, e->fp);
+}
+static void emit_sgr (struct emitter_t *e, const char *fmt, int val)
+{
+    char buf [32];
+    emit_nonprint (e, buf, snprintf (buf, sizeof (buf), fmt, val));
+}
+
+/* The xterm 256-color palette as RGB: 16 basic colors, a 6x6x6 cube and 24 grays  */
+static void xterm_rgb (int ix, int rgb [3])
+{
+    static const uint8_t basic [16][3] = {
+        {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0}, {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+        {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0}, {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+    };
+    static const uint8_t cube [6] = {0, 95, 135, 175, 215, 255};
+
+    if (ix < 16)
+    {
+        rgb [0] = basic [ix][0]; rgb [1] = basic [ix][1]; rgb [2] = basic [ix][2];
+    }
+    else
+    if (ix < 232)
+    {
+        ix -= 16;
+        rgb [0] = cube [ix / 36]; rgb [1] = cube [(ix / 6) % 6]; rgb [2] = cube [ix % 6];
+    }
+    else
+        rgb [0] = rgb [1] = rgb [2] = 8 + (ix - 232) * 10;
+}
+
+/* Closest of the first NCOLORS xterm colors to xterm color IX  */
+static int nearest_color (int ix, int ncolors)
+{
+    int rgb [3], best = 0, bestdist = 1 << 30, cx;
+
+    if (ix < ncolors)
+        return ix;
+    xterm_rgb (ix, rgb);
+    for (cx = 0; cx < ncolors; ++cx)
+    {
+        int crgb [3], dist;
+        xterm_rgb (cx, crgb);
+        dist = (rgb [0] - crgb [0]) * (rgb [0] - crgb [0]) + (rgb [1] - crgb [1]) * (rgb [1] - crgb [1])
+               + (rgb [2] - crgb [2]) * (rgb [2] - crgb [2]);
+        if (dist < bestdist)
+        {
+            bestdist = dist;
+            best = cx;
+        }
+    }
+    return best;
+}
+
+/* 256-color SGR if the terminal has it, else the nearest of the 16 or 8
+   basic colors, else nothing at all.  */
+static void emit_color (struct emitter_t *e, int bg_p, int code)
+{
+    int ix = xctab (code);
+
+    if (term_colors >= 256)
+        emit_sgr (e, (bg_p) ? "\\e[48;5;%dm" : "\\e[38;5;%dm", ix);
+    else
+    if (term_colors > 0)
+    {
+        ix = nearest_color (ix, term_colors);
+        emit_sgr (e, "\\e[%dm", (ix < 8) ? ((bg_p) ? 40 : 30) + ix : ((bg_p) ? 100 : 90) + ix - 8);
+    }
+}
+static void emit_fgcolor (struct emitter_t *e, int code) { emit_color (e, 0, code); }
+static void emit_bgcolor (struct emitter_t *e, int code) { emit_color (e, 1, code); }
+//static const char sitm [] = "\x1b[3m", ritm [] = "\x1b[0m";
+static void emit_fontface (struct emitter_t *e, unsigned fontface) { emit_sgr (e, "\\e[%dm", (fontface) ? 3 : 0); }
+
 /* Bash PS1 prompt handling doesn't seem to grok UTF8 characters and
    ends up getting the prompt width wrong, affecting screen redrawing.
    We work around this by writing a space ' ' followed by 
           \[ BACKSPACE UTF8-CHAR-BYTES \] 
    Bash excludes what's in the \[ ... \] brackets from prompt length 
    calculations.  
-   Returns 1 if we ended the D string with a \[ ... \] sequence (caller
-   might be able to use this info to avoid immediately adding another
-   \[ if another nonprintable is being added.)
-
-   Grossly inefficient, be careful out there!
+   Runs of ASCII are written out in one go.
    XXX Maybe a better solution would be to use tput?  */
 
-static int strcpy_with_utf8_encoding (char *d, const char *s)
+static void emit_text (struct emitter_t *e, const char *s, size_t n)
 {
-    int last_was_esc_p = 0;
+    const char *const end = s + n;
+    const char *run = s;                        /* Start of pending run of ASCII  */
     int len;
 
     if (bash_handles_utf8_p)                    /* User has a bash/readline that groks UTF-8  */
     {
-        strcpy (d, s);
-        return 0;
+        emit_print (e, s, n);
+        return;
     }
 
-    while ((len = get_char_len_utf8 (s)) > 0)   /* LEN normally 1 unless we're at a UTF-8 char  */
+    while (s < end && (len = get_char_len_utf8 (s)) > 0)   /* LEN normally 1 unless we're at a UTF-8 char  */
     {
-        if (len > 1)                            /* UTF-8  */
+        if (len > 1 && len <= end - s)          /* UTF-8 (and not cut short by a truncated view)  */
         {   
-            *d++ = ' ';                         /* ONE space  */
-            *d++ = '\\'; *d++ = '[';            /* Bash begin sequence of nonprinting characters  */
-            *d++ = '\\'; 
-            *d++ = '0'; *d++ = '1'; *d++ = '0'; /* ONE Octal BACKSPACE ^H 010  */
-            while (len--)
-                *d++ = *s++;                    /* Copy UTF8 sequence  */
-            *d++ = '\\'; *d++ = ']';            /* Bash end sequence of nonprinting characters  */
-            last_was_esc_p = 1;
+            emit_print (e, run, s - run);
+            emit_print (e, " ", 1);             /* ONE space  */
+            emit_nonprint (e, "\\010", 4);      /* ONE Octal BACKSPACE ^H 010  */
+            emit_nonprint (e, s, len);          /* Copy UTF8 sequence  */
+            run = (s += len);
         }
         else                                    /* ASCII  */
-        {
-            *d++ = *s++;
-            last_was_esc_p = 0;
-        }
+            ++s;
     }
-    *d = 0;                                     /* Ensure string is terminated  */
-    return last_was_esc_p;
-}                                               /* strcpy_with_utf8_encoding ()  */
+    emit_print (e, run, s - run);
+}                                               /* emit_text ()  */
                                                     
-/* Extended append an item to the PS1 segment list  - explicitly specifies everything!  */
-static void xappend (struct segs *s, const char *item, int fg, int bg, const char *sep, int sep_fg, unsigned fontface)
+/* Extended append an item to the PS1 segment list  - explicitly specifies everything!
+   The NPARTS views in PARTS are drawn one after the other as the item text.  */
+static void xappendv (struct segs *s, const struct strview_t *parts, unsigned nparts, int fg, int bg, const char *sep, int sep_fg, unsigned fontface)
 {
-    assert (s->nsegs < MAXSEGS);
+    assert (nparts <= SEG_MAXPARTS);
+    s->segs = grow_array (s->segs, &s->maxsegs, s->nsegs + 1, sizeof (*s->segs));
+
     struct segment_t *sp = s->segs + s->nsegs++;
     sp->fgcolor = fg;
     sp->bgcolor = bg;
     sp->sep_fg = sep_fg;
     sp->fontface = fontface;
+    sp->sep = sep;
+    sp->nparts = nparts;
+    memcpy (sp->parts, parts, nparts * sizeof (*parts));
+}
 
-    assert (strlen (sep) < sizeof (sp->sep));           /* MUST have room to store separators  */
-    strcpy (sp->sep, sep);
-
-    strncpy (sp->item, item, sizeof (sp->item) - 1);    /* Item text, don't care so much...  */
-    sp->item [sizeof (sp->item) - 1] = 0;
+static void xappend (struct segs *s, const char *item, int fg, int bg, const char *sep, int sep_fg, unsigned fontface)
+{
+    struct strview_t v = strview (item);
+    xappendv (s, &v, 1, fg, bg, sep, sep_fg, fontface);
 }
 
 /* Append an item to the PS1 segment list - will use default separator  */
@@ -292,114 +437,138 @@ static void append (struct segs *s, const char *item, int fg, int bg, unsigned f
     xappend (s, item, fg, bg, info_symbols [symtyp].sep, bg, fontface);
 }
 
-/* Prints our various segments into the string which will eventually 
+/* As append (), but pad ITEM with a space either side unless we're --tight  */
+static void append_spaced (struct segs *s, const char *item, int fg, int bg, unsigned fontface)
+{
+    struct strview_t parts [3] = {{" ", 1}, strview (item), {" ", 1}};
+
+    if (spaced_p)
+        xappendv (s, parts, 3, fg, bg, info_symbols [symtyp].sep, bg, fontface);
+    else
+        append (s, item, fg, bg, fontface);
+}
+
+/* As append_spaced (), for ITEM text that comes from files or the environment.
+   PS1 goes through bash's backslash-escape decoding and then (with the
+   default promptvars) parameter, command and arithmetic expansion, so such
+   text must not be able to run anything.  We escape \ $ and ` for both
+   passes - "\\\\", "\\$", "\\`" - rather than as "\\" and "\$", as
+   bash turns the latter into '#' for root, and then "\$(cmd)" would run
+   cmd for everyone else.  Control characters are dropped.  */
+static void append_quoted (struct segs *s, const char *item, int fg, int bg, unsigned fontface)
+{
+    char        *buf, *d;
+    const char  *cp;
+
+    if ((buf = malloc (4 * strlen (item) + 1)) == NULL)     /* Lives until we exit  */
+        fatal ("tpwl: out of memory\n");
+    for (d = buf, cp = item; *cp; ++cp)
+    {
+        const uint8_t c = *cp;
+        if (c < 0x20 || c == 0x7F)
+            continue;
+        if (c == '\\')
+        {
+            memcpy (d, "\\\\\\\\", 4);
+            d += 4;
+            continue;
+        }
+        if (c == '$' || c == '`')
+        {
+            *d++ = '\\';
+            *d++ = '\\';
+        }
+        *d++ = c;
+    }
+    *d = 0;
+    append_spaced (s, buf, fg, bg, fontface);
+}
+
+/* Prints our various segments to FP as a string which will eventually 
    be used as a bash PS1 prompt. 
    TITLE will be non-null if we're to set the window's title to CWD.  
    TITLE_USER_HOST_P says whether to prepend user@host to the window's title.  */
 
-static char *drawsegs (char *line, const struct segs *s, const char *title, int title_user_host_p)
+static void drawsegs (FILE *fp, const struct segs *s, const char *title, int title_user_host_p)
 {
-    unsigned ix;
+    struct emitter_t e = {fp, 0};
+    size_t   ix;
+    unsigned px;
     unsigned last_fg = CI_NONE, last_bg = CI_NONE;  /* Try to optimise  */
     unsigned last_fontface = FACE_NORMAL;
-    int      last_was_escape_p = 0;
-    char     colors [256];
 
-    line [0] = 0;
     for (ix = 0; ix < s->nsegs; ++ix)
     {
         const struct segment_t  *sp = s->segs + ix;
 
-        colors [0] = 0;
+        /* Color changes are nonprintable and so end up escaped from bash;
+           consecutive ones are merged into one \[ ... \] sequence.  */
         if (sp->fgcolor != last_fg)
-            append_fgcolor (colors, last_fg = sp->fgcolor);
+            emit_fgcolor (&e, last_fg = sp->fgcolor);
         if (sp->bgcolor != last_bg)
-            append_bgcolor (colors, last_bg = sp->bgcolor);
-        if (sp->fontface != last_fontface)
-            append_fontface (colors, last_fontface = sp->fontface);
-
-        /* If we added nonprintable stuff, escape them from bash.
-           If last_was_escape_p is true, we overwrite the previously-emitted
-           closing \] and thereby extend the previous \[ ... \] nonprintable
-           escape sequence.  */
-
-        if (colors [0])
-        {
-            char *lp = line + strlen (line) - ((last_was_escape_p) ? 2 : 0);
-            sprintf (lp, "%s%s\\]", (last_was_escape_p) ? "" : "\\[", colors);
-        }
+            emit_bgcolor (&e, last_bg = sp->bgcolor);
+        if ((sp->fontface & term_faces) != last_fontface)
+            emit_fontface (&e, last_fontface = sp->fontface & term_faces);
 
         /* This adds the actual text - which could have UTF8 encodings and so
            end up with a bash nonprintable escape sequence.  */
 
-        last_was_escape_p = strcpy_with_utf8_encoding (line + strlen (line), sp->item);
+        for (px = 0; px < sp->nparts; ++px)
+            emit_text (&e, sp->parts [px].str, sp->parts [px].len);
 
         /* Now add any final colors - also nonprintable  */
-        colors [0] = 0;
         if (ix < s->nsegs - 1)
         {
             const struct segment_t *next = sp + 1;
             if (next->bgcolor != last_bg)
-                append_bgcolor (colors, last_bg = next->bgcolor);
+                emit_bgcolor (&e, last_bg = next->bgcolor);
         }
         else                                        /* Last segment  */
         {
-            strcat (colors, "\\e[0m");              /* Reset all attributes  */
+            emit_nonprint (&e, "\\e[0m", 5);        /* Reset all attributes  */
             last_fg = last_bg = CI_NONE;
         }
         if (sp->sep_fg != last_fg && sp->sep [0])
-            append_fgcolor (colors, last_fg = sp->sep_fg);
+            emit_fgcolor (&e, last_fg = sp->sep_fg);
 
-        if (colors [0])
-        {
-            char *lp = line + strlen (line) - ((last_was_escape_p) ? 2 : 0);
-            sprintf (lp, "%s%s\\]", (last_was_escape_p) ? "" : "\\[", colors);
-        }
-
-        last_was_escape_p = strcpy_with_utf8_encoding (line + strlen (line), sp->sep);
+        emit_text (&e, sp->sep, strlen (sp->sep));
     }
 
     /* Add any color resets and optionally set the terminal window title.
        These aren't bash-printable and should be enclosed in \[ ... \]  */
 
-    colors [0] = 0;
     if (last_fg != CI_NONE || last_bg != CI_NONE)
-        strcat (colors, "\\e[0m");                  /* Reset all attributes  */
+        emit_nonprint (&e, "\\e[0m", 5);            /* Reset all attributes  */
 
     if (title != NULL)                              /* Want terminal window title  */
     {
         const char *btitle = (title_user_host_p) ? "\\u@\\h: \\w" : "\\w";  /* user@host CWD or just CWD  */
 
-        strcat (colors, "\\e]0;");                  /* SET TERM TITLE Escape sequence  */
+        emit_nonprint (&e, "\\e]0;", 5);            /* SET TERM TITLE Escape sequence  */
 
         if (title [0] == '^')                       /* Extra Title string comes first  */
         {
             if (title [1] != 0)                     /* ... and there IS an extra title string  */
             {
-                strncat (colors, title + 1, 96);    /* skip the initial '^', impose abritrary length cap :)  */
-                strcat (colors, " - ");
+                emit_nonprint (&e, title + 1, strnlen (title + 1, 96));    /* skip the initial '^', impose abritrary length cap :)  */
+                emit_nonprint (&e, " - ", 3);
             }
-            strcat (colors, btitle);                /* bash 'user @ host  cwd' window title  */
+            emit_nonprint (&e, btitle, strlen (btitle));    /* bash 'user @ host  cwd' window title  */
         }
         else
         if (title [0] != 0)                         /* Extra title string appended to the window title  */
         {
-            strcat (colors, btitle);                /* bash 'user @ host  cwd' window title  */
-            strcat (colors, " - ");
-            strncat (colors, title, 96);
+            emit_nonprint (&e, btitle, strlen (btitle));    /* bash 'user @ host  cwd' window title  */
+            emit_nonprint (&e, " - ", 3);
+            emit_nonprint (&e, title, strnlen (title, 96));
         }
         else                                        /* Default title  */
-            strcat (colors, btitle);                /* bash 'user @ host  cwd' window title  */
+            emit_nonprint (&e, btitle, strlen (btitle));    /* bash 'user @ host  cwd' window title  */
 
-        strcat (colors, "\\a");                     /* Finish off SET TERM TITLE  */
-    }
-    if (colors [0])                                 /* Emit escaped string  */
-    {
-        char *lp = line + strlen (line) - ((last_was_escape_p) ? 2 : 0);
-        sprintf (lp, "%s%s\\]", (last_was_escape_p) ? "" : "\\[", colors);
+        emit_nonprint (&e, "\\a", 2);               /* Finish off SET TERM TITLE  */
     }
-
-    return line;
+    if (e.nonprint_p)
+        fputs ("\\]", fp);                          /* Close any open \[ sequence  */
 }                                                   /* drawsegs ()  */
 
 static void add_host (struct segs *s, const char *host, unsigned fontface)
@@ -451,52 +620,54 @@ static void add_cwd (struct segs *s, const char *cwd, const char *homedir, int m
 
     if (*cwd)
     {
-        enum {MAXDIRS=80};
-        const char *cp = cwd;
-        const char *dirs [MAXDIRS];             /* Ludicrously large  */
-        uint16_t    lens [MAXDIRS];
-        uint8_t     using_p [MAXDIRS];
-        int         totlen = strlen (cwd);
-        int         ndirs = 0;
+        const struct symbol_info_t *const si = info_symbols + symtyp;
+        const struct strview_t ellipsis = strview (si->ellipsis);
+        const struct strview_t space = {" ", 1};
+        const char  *cp = cwd;
+        struct strview_t *dirs = NULL;          /* Component directories, pointing into CWD  */
+        size_t      maxdirs = 0;
+        size_t      ndirs = 0;
+        size_t      totlen;
+        size_t      nfirst, nlast;              /* Using first NFIRST and last NLAST dirs  */
+        size_t      ix;
         int         entire_p = 0;
         int         dir_missing_ellipsis_needed_p = 0;
-        int         ix;
-        int         abs_max_depth = (max_depth < 0) ? - max_depth : max_depth;
+        long long   abs_max_depth = (max_depth < 0) ? - (long long) max_depth : max_depth;
 
         /* FIXME this only works for ASCII pathnames  */
-        //fprintf (stderr, "CWD is '%s' (len %d), max_depth %d, max_dir_len %d\n", cwd, totlen, max_depth, max_dir_len);
+        //fprintf (stderr, "CWD is '%s', max_depth %d, max_dir_len %d\n", cwd, max_depth, max_dir_len);
 
         if (cp [0] != '/')                      /* Path doesn't start at /  */
-            dirs [ndirs++] = cp;                /* So first element is always a dir  */
-
-        while (*cp)                             /* Split into component directories  */
+        {                                       /* So first element is always a dir  */
+            dirs = grow_array (dirs, &maxdirs, ndirs + 1, sizeof (*dirs));
+            dirs [ndirs++].str = cp;
+        }
+        for (; *cp; ++cp)                       /* Split into component directories - one pass  */
         {
             if (*cp == '/' && cp [1] != '/')    /* Double-slash counts as one  */
             {
                 if (ndirs)
-                    lens [ndirs - 1] = cp - dirs [ndirs - 1];
-                dirs [ndirs++] = cp;
+                    dirs [ndirs - 1].len = cp - dirs [ndirs - 1].str;
+                dirs = grow_array (dirs, &maxdirs, ndirs + 1, sizeof (*dirs));
+                dirs [ndirs++].str = cp;
             }
-            ++cp;
-            if (ndirs >= MAXDIRS - 1)
-                break;
         }
         if (ndirs)
-            lens [ndirs - 1] = cp - dirs [ndirs - 1];
+            dirs [ndirs - 1].len = cp - dirs [ndirs - 1].str;
+        totlen = cp - cwd;
 
         /* If we're not splitting, and ALL the text fits, just spew it... up to final '/' anyway  */
-        if (! split_p && totlen < abs_max_depth * max_dir_len) 
+        if (! split_p && (long long) totlen < abs_max_depth * max_dir_len) 
         {
             abs_max_depth = ndirs;
             entire_p = 1;
         }
 
-        if (ndirs > abs_max_depth)              /* We'll be skipping at least one dir...  */
+        nfirst = ndirs;                         /* Using all dirs by default  */
+        nlast = 0;
+        if ((long long) ndirs > abs_max_depth)  /* We'll be skipping at least one dir...  */
         {
-            int avail = abs_max_depth - 1;
-            int usinglen = 0, fx = 0, lx = ndirs - 1;
-
-            memset (using_p, 0, ndirs);         /* Say we're not using any dir component  */
+            size_t usinglen = 0;
 
             /* We're going to use an ellipsis in place of missing directories
                in the displayed path (but only if we are displaying more than
@@ -504,79 +675,1351 @@ static void add_cwd (struct segs *s, const char *cwd, const char *homedir, int m
             dir_missing_ellipsis_needed_p = (abs_max_depth > 1);
 
             /* If max_depth is negative, only lastmost dirs are used.
-               Otherwise, it's organised as follows: LAST FIRST LAST-1 FIRST+1 ...  */
-            do
-            {
-                usinglen += lens [lx];
-                using_p [lx--] = 1;
-                if (--avail >= 0 && max_depth > 0)
-                {
-                    usinglen += lens [fx];
-                    using_p [fx++] = 1;
-                    --avail;
-                }
-            } while (avail >= 0);
+               Otherwise, it's split as LAST FIRST LAST-1 FIRST+1 ... which
+               favours the last dirs by one if DEPTH is odd.  Always at least
+               the very last dir.  */
+            nfirst = (max_depth > 0) ? abs_max_depth / 2 : 0;
+            nlast = abs_max_depth - nfirst;
+            if (nlast == 0)
+                nlast = 1;
+
+            for (ix = 0; ix < nfirst; ++ix)
+                usinglen += dirs [ix].len;
+            for (ix = ndirs - nlast; ix < ndirs; ++ix)
+                usinglen += dirs [ix].len;
 
             /* If all the text we're using "fits", we can avoid truncating 
                directory names.  */
-            if (usinglen < abs_max_depth * max_dir_len)
+            if ((long long) usinglen < abs_max_depth * max_dir_len)
                 entire_p = 1;
         }
-        else
-            memset (using_p, 1, ndirs);         /* Using all dirs  */
 
         for (ix = 0; ix < ndirs; ++ix)          /* Output the dirs we're using  */
         {
-            if (using_p [ix])                   /* Using this one  */
-            {
-                const struct symbol_info_t *const si = info_symbols + symtyp;
+            if (ix == nfirst && ix < ndirs - nlast)
+                ix = ndirs - nlast;             /* Skip over the dirs we're not using  */
 
-                char        thisdir [1024];
-                char        *tp = thisdir;
-                int         thislen = lens [ix];
-                const char  *component_ptr = dirs [ix];
-                const int   last_p = (ix == ndirs - 1);
-                int         fgx = (last_p) ? CWD_FG : PATH_FG;
+            struct strview_t parts [SEG_MAXPARTS];
+            struct strview_t dir = dirs [ix];
+            unsigned    nparts = 0;
+            const int   last_p = (ix == ndirs - 1);
+            int         fgx = (last_p) ? CWD_FG : PATH_FG;
 
-                *tp = 0;
-                if (dir_missing_ellipsis_needed_p && ix > 0 && using_p [ix - 1] == 0)
-                {
-                    dir_missing_ellipsis_needed_p = 0;
-                    strcpy (tp, si->ellipsis);      /* Don't UTF8-copy - that gets done when we draw the line  */
-                    while (*tp)                     /* Skip to end of ellipsis  */
-                        ++tp;
-                }
+            if (dir_missing_ellipsis_needed_p && ix > 0 && ix == ndirs - nlast)
+            {
+                dir_missing_ellipsis_needed_p = 0;
+                parts [nparts++] = ellipsis;    /* Don't UTF8-encode - that gets done when we draw the line  */
+            }
 
-                if (split_p || abs_max_depth == 1)
+            if (split_p || abs_max_depth == 1)
+            {
+                /* Toss leading slash, unless that's all there is!  */
+                if (dir.str [0] == '/' && dir.len > 1)
                 {
-                    /* Toss leading slash, unless that's all there is!  */
-                    if (component_ptr [0] == '/' && thislen > 1)
-                    {
-                        ++component_ptr;
-                        --thislen;
-                    }
-                    if (spaced_p)
-                        *tp++ = ' ';                /* Extra space if splitting components (or if only one!)  */
+                    ++dir.str;
+                    --dir.len;
                 }
+                if (spaced_p)
+                    parts [nparts++] = space;   /* Extra space if splitting components (or if only one!)  */
+            }
 
-                memcpy (tp, component_ptr, thislen);
-                tp [thislen] = 0;                   /* truncate this path component (directory)  */
-                //fprintf (stderr, "%d: '%s'  (len %d)\n", ix, thisdir, thislen);
-                if (! entire_p && thislen > (max_dir_len+1))    /* +1 allows for  '/'  */
-                    strcpy (tp + max_dir_len - si->ellipsis_width, si->ellipsis);
-                else
+            if (! entire_p && dir.len > (size_t) (max_dir_len+1))  /* +1 allows for  '/'  */
+            {
+                dir.len = max_dir_len - si->ellipsis_width;         /* truncate this path component (directory)  */
+                parts [nparts++] = dir;
+                parts [nparts++] = ellipsis;
+            }
+            else
+            {
+                parts [nparts++] = dir;
                 if ((last_p || split_p) && spaced_p)
-                    strcat (thisdir, " ");          /* Extra space for split component  */
-
-                if (split_p && ! last_p)
-                    xappend (s, thisdir, fgx, PATH_BG, si->thin, SEPARATOR_FG, fontface);
-                else
-                    xappend (s, thisdir, fgx, PATH_BG, (last_p) ? si->sep : "", PATH_BG, fontface);
+                    parts [nparts++] = space;   /* Extra space for split component  */
             }
+
+            if (split_p && ! last_p)
+                xappendv (s, parts, nparts, fgx, PATH_BG, si->thin, SEPARATOR_FG, fontface);
+            else
+                xappendv (s, parts, nparts, fgx, PATH_BG, (last_p) ? si->sep : "", PATH_BG, fontface);
         }                                           /* for (ndirs)  */
+        free (dirs);
     }                                               /* if (*cwd)  */
 }                                                   /* add_cwd ()  */
 
+/* Things which are too expensive to work out for every prompt are cached
+   in small files in a private per-user directory.  A cache file holds a
+   KEY describing the inputs (eg file paths, mtimes and sizes), a null,
+   then the VALUE.  The cache is strictly best effort - any failure just
+   means we recompute.  */
+#define CACHE_MAX   4096
+#ifdef __APPLE__
+#define ST_MTIM(st) ((st).st_mtimespec)
+#define ST_CTIM(st) ((st).st_ctimespec)
+#else
+#define ST_MTIM(st) ((st).st_mtim)
+#define ST_CTIM(st) ((st).st_ctim)
+#endif
+
+static const char *cache_dir (void)
+{
+    static char dir [512];
+    static int  state;                      /* 0 untried, 1 usable, -1 unusable  */
+    const char  *rt = getenv ("XDG_RUNTIME_DIR");
+    struct stat st;
+
+    if (state == 0)
+    {
+        state = -1;
+        if (rt != NULL && rt [0] == '/')
+            snprintf (dir, sizeof (dir), "%s/tpwl", rt);
+        else
+            snprintf (dir, sizeof (dir), "/tmp/tpwl-%u", (unsigned) getuid ());
+
+        /* Don't trust a directory somebody else could have planted  */
+        if ((mkdir (dir, 0700) == 0 || errno == EEXIST) && lstat (dir, &st) == 0
+            && S_ISDIR (st.st_mode) && st.st_uid == getuid () && (st.st_mode & 077) == 0)
+            state = 1;
+    }
+    return (state > 0) ? dir : NULL;
+}
+
+/* If cache NAME was stored with KEY, copy its value to VAL and return 1.  */
+static int cache_load (const char *name, const char *key, char *val, size_t valsize)
+{
+    const char  *dir = cache_dir ();
+    const size_t keylen = strlen (key);
+    char        path [600], buf [2 * CACHE_MAX];
+    ssize_t     n;
+    int         fd;
+
+    if (dir == NULL)
+        return 0;
+    snprintf (path, sizeof (path), "%s/%s", dir, name);
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return 0;
+    n = read (fd, buf, sizeof (buf));
+    close (fd);
+
+    if (n <= (ssize_t) keylen || buf [keylen] != 0 || memcmp (buf, key, keylen) != 0)
+        return 0;                           /* Missing, stale or truncated  */
+
+    n -= keylen + 1;
+    if ((size_t) n >= valsize)
+        return 0;
+    memcpy (val, buf + keylen + 1, n);
+    val [n] = 0;
+    return 1;
+}
+
+/* Store VAL as the value of cache NAME for KEY.  Written to a temp file and
+   renamed so that concurrent prompts never see a partial cache file.  */
+static void cache_store (const char *name, const char *key, const char *val)
+{
+    const char  *dir = cache_dir ();
+    const size_t keylen = strlen (key), vallen = strlen (val);
+    char        path [600], tmp [600];
+    int         fd, ok;
+
+    if (dir == NULL)
+        return;
+    snprintf (path, sizeof (path), "%s/%s", dir, name);
+    snprintf (tmp, sizeof (tmp), "%s/.%s.%d", dir, name, (int) getpid ());
+    if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return;
+    ok = (write (fd, key, keylen + 1) == (ssize_t) (keylen + 1)   /* Includes the null  */
+          && write (fd, val, vallen) == (ssize_t) vallen);
+    if (close (fd) != 0 || ! ok || rename (tmp, path) != 0)
+        unlink (tmp);
+}
+
+/* Append a cache key element describing file PATH to KEY (of size KEYSIZE).
+   Anything which changes the file changes its key, and a missing file has
+   a key too so that creating it invalidates the cache.
+   Returns 0 if there's no room left in KEY.  */
+static int cache_key_file (char *key, size_t keysize, const char *path)
+{
+    const size_t len = strlen (key);
+    struct stat st;
+    int         n;
+
+    if (stat (path, &st) == 0)
+        n = snprintf (key + len, keysize - len, "%s %lld.%09ld %lld %llu\n", path,
+                      (long long) ST_MTIM (st).tv_sec, (long) ST_MTIM (st).tv_nsec,
+                      (long long) st.st_size, (unsigned long long) st.st_ino);
+    else
+        n = snprintf (key + len, keysize - len, "%s -\n", path);
+    return (n > 0 && (size_t) n < keysize - len);
+}
+
+static int strview_eq (struct strview_t v, const char *str)
+{
+    return (v.len == strlen (str) && memcmp (v.str, str, v.len) == 0);
+}
+
+/* One line of block-style YAML, as far as we care:  [- ]KEY: VALUE  */
+struct yaml_line_t {
+    int         dash_p;                     /* Line begins a list item  */
+    size_t      dashcol;                    /* Column of the '-' if DASH_P  */
+    size_t      keycol;                     /* Column at which KEY starts  */
+    struct strview_t key, val;              /* KEY is empty if not a key line  */
+};
+
+/* Parse the line at P into YL, returns the start of the next line.
+   Only plain or simply-quoted scalars; trailing comments are dropped.  */
+static const char *yaml_line (const char *p, const char *end, struct yaml_line_t *yl)
+{
+    const char *const bol = p;
+    const char *eol = memchr (p, '\n', end - p);
+    const char *q;
+
+    if (eol == NULL)
+        eol = end;
+    memset (yl, 0, sizeof (*yl));
+
+    while (p < eol && *p == ' ')
+        ++p;
+    if (p < eol && *p == '-' && (p + 1 == eol || p [1] == ' ' || p [1] == '\r'))
+    {
+        yl->dash_p = 1;
+        yl->dashcol = p - bol;
+        for (++p; p < eol && *p == ' '; ++p)
+            ;
+    }
+    if (p == eol || *p == '#')
+        return eol + (eol < end);
+
+    for (q = p; q < eol && ! (*q == ':' && (q + 1 == eol || q [1] == ' ' || q [1] == '\r')); ++q)
+        ;
+    if (q == eol)                           /* Not KEY: VALUE  */
+        return eol + (eol < end);
+
+    yl->keycol = p - bol;
+    yl->key.str = p;
+    yl->key.len = q - p;
+
+    for (p = q + 1; p < eol && *p == ' '; ++p)
+        ;
+    if (p < eol && (*p == '"' || *p == '\''))   /* Quoted - no escapes, sorry  */
+    {
+        q = memchr (p + 1, *p, eol - p - 1);
+        if (q != NULL)
+        {
+            yl->val.str = p + 1;
+            yl->val.len = q - p - 1;
+        }
+        return eol + (eol < end);
+    }
+    for (q = p; q < eol && ! (*q == '#' && q > p && q [-1] == ' '); ++q)
+        ;
+    while (q > p && (q [-1] == ' ' || q [-1] == '\r'))
+        --q;
+    yl->val.str = p;
+    yl->val.len = q - p;
+    return eol + (eol < end);
+}
+
+/* Minimal kubeconfig scanner - just enough for the block-style YAML that
+   kubectl itself writes (no flow style/JSON, anchors or multi-line scalars.)
+   Sets *CUR to the top-level 'current-context' if there is one.  If CTX is
+   non-NULL, looks in 'contexts' for the entry named CTX and sets *NS to its
+   'context: namespace:', returning 1 if that entry was found.  */
+static int kube_scan (const char *p, const char *end, struct strview_t *cur, const struct strview_t *ctx, struct strview_t *ns)
+{
+    struct yaml_line_t yl;
+    struct strview_t name = {NULL, 0}, item_ns = {NULL, 0};
+    size_t  list_col = 0;                   /* Column of the '-' of each context item  */
+    size_t  item_col = 0, ctx_col = 0;      /* Key columns of context item and its 'context:' mapping  */
+    int     in_contexts_p = 0, in_list_p = 0, in_item_ctx_p = 0, found_p = 0;
+
+    while (p < end)
+    {
+        p = yaml_line (p, end, &yl);
+        if (yl.key.len == 0 && ! yl.dash_p)
+            continue;
+
+        /* A new top-level key, or a new item of the contexts list itself
+           (not of some list nested inside an item, eg 'extensions:')  */
+        const int top_p = (yl.keycol == 0 && ! yl.dash_p);
+        const int item_p = (in_contexts_p && yl.dash_p && (! in_list_p || yl.dashcol == list_col));
+
+        if (top_p || item_p)
+        {
+            if (ctx != NULL && ! found_p && name.len == ctx->len && memcmp (name.str, ctx->str, name.len) == 0)
+            {
+                *ns = item_ns;
+                found_p = 1;
+            }
+            name.len = item_ns.len = 0;
+            in_item_ctx_p = 0;
+        }
+        if (top_p)
+        {
+            in_contexts_p = strview_eq (yl.key, "contexts");
+            in_list_p = 0;
+            if (strview_eq (yl.key, "current-context"))
+                *cur = yl.val;
+            continue;
+        }
+        if (item_p)
+        {
+            in_list_p = 1;
+            list_col = yl.dashcol;
+            item_col = (yl.key.len) ? yl.keycol : 0;    /* Bare '-': next key sets it  */
+        }
+        if (! in_list_p || yl.key.len == 0)
+            continue;
+
+        if (item_col == 0)
+            item_col = yl.keycol;
+        if (yl.keycol == item_col)          /* name: or context: of this item  */
+        {
+            if ((in_item_ctx_p = strview_eq (yl.key, "context")))
+                ctx_col = 0;
+            else
+            if (strview_eq (yl.key, "name"))
+                name = yl.val;
+        }
+        else                                /* Deeper: only of interest inside 'context:'  */
+        if (in_item_ctx_p && yl.keycol > item_col)
+        {
+            if (ctx_col == 0)
+                ctx_col = yl.keycol;        /* First key sets the column of the mapping  */
+            if (yl.keycol == ctx_col && strview_eq (yl.key, "namespace"))
+                item_ns = yl.val;
+        }
+    }
+    if (ctx != NULL && ! found_p && name.len == ctx->len && memcmp (name.str, ctx->str, name.len) == 0)
+    {
+        *ns = item_ns;
+        found_p = 1;
+    }
+    return found_p;
+}
+
+/* Work out the current kube context and namespace from the kubeconfig
+   files listed in CONFIGS (colon-separated, like KUBECONFIG) without
+   running kubectl.  As kubectl does, the first file to set current-context
+   wins, as does the first file to define the context itself.
+   Leaves "CONTEXT\nNAMESPACE" in VAL, or "" if there is no current context.  */
+static void kube_parse (const char *configs, char *val, size_t valsize)
+{
+    struct strview_t *maps = NULL;          /* mmap'd kubeconfig files  */
+    size_t      nmaps = 0, maxmaps = 0, ix;
+    struct strview_t cur = {NULL, 0}, ns = {NULL, 0};
+    const char  *cp, *next;
+    char        path [4096];
+
+    for (cp = configs; *cp; cp = next)
+    {
+        struct stat st;
+        void        *addr;
+        int         fd;
+
+        next = strchr (cp, ':');
+        if (next == NULL)
+            next = cp + strlen (cp);
+        snprintf (path, sizeof (path), "%.*s", (int) (next - cp), cp);
+        if (*next) ++next;
+
+        if (path [0] == 0 || (fd = open (path, O_RDONLY)) < 0)
+            continue;
+        if (fstat (fd, &st) == 0 && st.st_size > 0
+            && (addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+        {
+            maps = grow_array (maps, &maxmaps, nmaps + 1, sizeof (*maps));
+            maps [nmaps].str = addr;
+            maps [nmaps++].len = st.st_size;
+        }
+        close (fd);
+    }
+
+    for (ix = 0; ix < nmaps && cur.len == 0; ++ix)
+        kube_scan (maps [ix].str, maps [ix].str + maps [ix].len, &cur, NULL, NULL);
+    for (ix = 0; ix < nmaps && cur.len != 0; ++ix)
+    {
+        struct strview_t dummy;
+        if (kube_scan (maps [ix].str, maps [ix].str + maps [ix].len, &dummy, &cur, &ns))
+            break;
+    }
+
+    if (cur.len == 0 || snprintf (val, valsize, "%.*s\n%.*s", (int) cur.len, cur.str, (int) ns.len, ns.str) >= (int) valsize)
+        val [0] = 0;
+
+    for (ix = 0; ix < nmaps; ++ix)
+        munmap ((void *) maps [ix].str, maps [ix].len);
+    free (maps);
+}
+
+/* Kubernetes context (and namespace, if one's set) from $KUBECONFIG or
+   ~/.kube/config.  The answer is cached, keyed on the config files' paths,
+   mtimes and sizes, so that an unchanged config costs only a stat ().  */
+static void add_kube (struct segs *s, unsigned fontface)
+{
+    static char val [CACHE_MAX];            /* Segment text points in here  */
+    char        key [CACHE_MAX] = "";
+    char        defconfig [4096];
+    const char  *configs = getenv ("KUBECONFIG");
+    const char  *home = getenv ("HOME");
+    const char  *cp, *next;
+    char        path [4096];
+    int         keyed_p = 1;
+
+    if (configs == NULL || configs [0] == 0)
+    {
+        if (home == NULL || home [0] == 0)
+            return;
+        snprintf (defconfig, sizeof (defconfig), "%s/.kube/config", home);
+        configs = defconfig;
+    }
+
+    for (cp = configs; *cp && keyed_p; cp = next)
+    {
+        next = strchr (cp, ':');
+        if (next == NULL)
+            next = cp + strlen (cp);
+        snprintf (path, sizeof (path), "%.*s", (int) (next - cp), cp);
+        if (*next) ++next;
+        if (path [0])
+            keyed_p = cache_key_file (key, sizeof (key), path);
+    }
+
+    if (! keyed_p || ! cache_load ("kube", key, val, sizeof (val)))
+    {
+        kube_parse (configs, val, sizeof (val));
+        if (keyed_p)
+            cache_store ("kube", key, val);
+    }
+
+    char *nl = strchr (val, '\n');          /* "CONTEXT\nNAMESPACE" -> "CONTEXT:NAMESPACE"  */
+    if (nl != NULL)
+    {
+        if (nl [1] != 0) *nl = ':';
+        else *nl = 0;
+    }
+    if (val [0] != 0)
+        append_quoted (s, val, KUBE_FG, KUBE_BG, fontface);
+}
+
+/* Compiled terminfo entries are little-endian 16-bit values...  */
+static int ti_short (const uint8_t *p) { int v = p [0] | (p [1] << 8); return (v & 0x8000) ? v - 0x10000 : v; }
+/* ... but numbers are 32-bit in the "extended number" format  */
+static long ti_num (const uint8_t *p, int numsize)
+{
+    return (numsize == 2) ? ti_short (p) : (long) (int32_t) (p [0] | (p [1] << 8) | (p [2] << 16) | ((uint32_t) p [3] << 24));
+}
+
+/* Minimal parser for the compiled terminfo entry of LEN bytes at P - see
+   term(5).  We only want max_colors, enter_italics_mode, and the RGB/Tc
+   extended capabilities which indicate direct ("true") color.
+   Returns -1 if this doesn't look like a terminfo entry.  */
+enum {TI_MAX_COLORS = 13, TI_ENTER_ITALICS_MODE = 311};
+static int terminfo_parse (const uint8_t *p, size_t len, long *colors, int *italic_p, int *truecolor_p)
+{
+    size_t  off, eoff, strtab, names;
+    int     numsize, nbools, nnums, nstrs, ix;
+
+    if (len < 12)
+        return -1;
+    if (ti_short (p) == 0432)               /* Legacy format  */
+        numsize = 2;
+    else
+    if (ti_short (p) == 01036)              /* ncurses 6.1+ extended number format  */
+        numsize = 4;
+    else
+        return -1;
+
+    nbools = ti_short (p + 4);
+    nnums = ti_short (p + 6);
+    nstrs = ti_short (p + 8);
+    if (ti_short (p + 2) < 0 || nbools < 0 || nnums < 0 || nstrs < 0 || ti_short (p + 10) < 0)
+        return -1;
+
+    off = 12 + ti_short (p + 2) + nbools;   /* Skip header, names and booleans  */
+    off += off & 1;                         /* Numbers are aligned  */
+    strtab = off + nnums * numsize + nstrs * 2;
+    if (strtab + ti_short (p + 10) > len)
+        return -1;
+
+    *colors = (nnums > TI_MAX_COLORS) ? ti_num (p + off + TI_MAX_COLORS * numsize, numsize) : -1;
+    *italic_p = (nstrs > TI_ENTER_ITALICS_MODE && ti_short (p + off + nnums * numsize + TI_ENTER_ITALICS_MODE * 2) >= 0);
+    *truecolor_p = (*colors >= 0x1000000);  /* eg xterm-direct  */
+
+    /* Extended (user-defined) capabilities follow, if present - look for RGB or Tc  */
+    eoff = strtab + ti_short (p + 10);
+    eoff += eoff & 1;
+    if (eoff + 10 > len)
+        return 0;
+
+    const int   xbools = ti_short (p + eoff), xnums = ti_short (p + eoff + 2), xstrs = ti_short (p + eoff + 4);
+    const size_t xboolp = eoff + 10;
+    size_t      xnump, xstrp, xnamep, xtab;
+
+    if (xbools < 0 || xnums < 0 || xstrs < 0)
+        return 0;
+    xnump = xboolp + xbools;
+    xnump += xnump & 1;
+    xstrp = xnump + xnums * numsize;
+    xnamep = xstrp + xstrs * 2;
+    xtab = xnamep + (xbools + xnums + xstrs) * 2;
+    if (xtab > len)
+        return 0;
+
+    /* The string table holds the string values, then the capability names  */
+    for (names = 0, ix = 0; ix < xstrs; ++ix)
+    {
+        const int soff = ti_short (p + xstrp + ix * 2);
+        const uint8_t *str = p + xtab + soff;
+        if (soff >= 0 && xtab + soff < len)
+        {
+            const uint8_t *nul = memchr (str, 0, len - xtab - soff);
+            if (nul != NULL && (size_t) (nul + 1 - (p + xtab)) > names)
+                names = nul + 1 - (p + xtab);
+        }
+    }
+    for (ix = 0; ix < xbools + xnums + xstrs; ++ix)
+    {
+        const int   noff = ti_short (p + xnamep + ix * 2);
+        const char  *name = (const char *) p + xtab + names + noff;
+        int         set_p;
+
+        /* Names are null-terminated - the last may end right at the end of the file  */
+        if (noff < 0 || xtab + names + noff >= len || memchr (name, 0, len - (xtab + names + noff)) == NULL)
+            continue;
+        if (ix < xbools)
+            set_p = (p [xboolp + ix] == 1);
+        else
+        if (ix < xbools + xnums)
+            set_p = (ti_num (p + xnump + (ix - xbools) * numsize, numsize) > 0);
+        else
+            set_p = (ti_short (p + xstrp + (ix - xbools - xnums) * 2) >= 0);
+        if (set_p && (strcmp (name, "RGB") == 0 || strcmp (name, "Tc") == 0))
+            *truecolor_p = 1;
+    }
+    return 0;
+}
+
+/* Fill DIRS (of at least 64) with the directories ncurses searches for
+   terminfo entries, in order, and return how many.  */
+static int terminfo_dirs (const char **dirs)
+{
+    static const char *const sysdirs [] = {"/etc/terminfo", "/lib/terminfo", "/usr/share/terminfo", "/usr/lib/terminfo", NULL};
+    static char homedir [4096], tdirs [4096];
+    const char  *env;
+    int         ndirs = 0, ix;
+
+    if ((env = getenv ("TERMINFO")) != NULL && env [0])
+        dirs [ndirs++] = env;
+    if ((env = getenv ("HOME")) != NULL && env [0])
+    {
+        snprintf (homedir, sizeof (homedir), "%s/.terminfo", env);
+        dirs [ndirs++] = homedir;
+    }
+
+    /* TERMINFO_DIRS is colon-separated; an empty entry means the system dirs  */
+    char        *cp, *next;
+    int         sys_p = 1;
+    if ((env = getenv ("TERMINFO_DIRS")) != NULL && env [0])
+    {
+        snprintf (tdirs, sizeof (tdirs), "%s", env);
+        for (cp = tdirs, sys_p = 0; cp != NULL; cp = next)
+        {
+            if ((next = strchr (cp, ':')) != NULL)
+                *next++ = 0;
+            if (*cp == 0)
+                sys_p = 1;
+            else
+            if (ndirs < 48)
+                dirs [ndirs++] = cp;
+        }
+    }
+    for (ix = 0; sys_p && sysdirs [ix]; ++ix)
+        dirs [ndirs++] = sysdirs [ix];
+    return ndirs;
+}
+
+/* Look for the compiled terminfo entry for TERM in the same places (and
+   order) as ncurses does.  Leaves its pathname in PATH and returns 1 if found.  */
+static int terminfo_find (const char *term, char *path, size_t pathsize)
+{
+    const char  *dirs [64];
+    const int   ndirs = terminfo_dirs (dirs);
+    int         ix;
+
+    for (ix = 0; ix < ndirs; ++ix)          /* Entries live in a subdir named by their first char, or its hex  */
+    {
+        if (snprintf (path, pathsize, "%s/%c/%s", dirs [ix], term [0], term) < (int) pathsize && access (path, R_OK) == 0)
+            return 1;
+        if (snprintf (path, pathsize, "%s/%02x/%s", dirs [ix], (uint8_t) term [0], term) < (int) pathsize && access (path, R_OK) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Append to KEY cache key elements covering everywhere an entry for TERM
+   could appear: in each search directory, the subdirectory it would go in
+   if there is one, else the directory itself (creating the subdirectory
+   changes that).  One stat per directory, mostly.  */
+static int terminfo_dirs_key (char *key, size_t keysize, const char *term)
+{
+    const char  *dirs [64];
+    const int   ndirs = terminfo_dirs (dirs);
+    char        sub [2][4200];
+    size_t      len;
+    int         ix, jx;
+
+    for (ix = 0; ix < ndirs; ++ix)
+    {
+        snprintf (sub [0], sizeof (sub [0]), "%s/%c", dirs [ix], term [0]);
+        snprintf (sub [1], sizeof (sub [1]), "%s/%02x", dirs [ix], (uint8_t) term [0]);
+        len = strlen (key);
+        for (jx = 0; jx < 3; ++jx)
+        {
+            key [len] = 0;
+            if (! cache_key_file (key, keysize, (jx < 2) ? sub [jx] : dirs [ix]))
+                return 0;
+            if (strcmp (key + strlen (key) - 3, " -\n") != 0)
+                break;                      /* Exists  */
+        }
+    }
+    return 1;
+}
+
+/* Set term_colors and term_faces from the terminfo entry for $TERM so we
+   don't send escapes the terminal can't handle.  Linking ncurses would
+   cost more than everything else we do, so we read the compiled entry
+   ourselves and cache what we learn per TERM value; a cache hit costs a
+   read and one stat () to check the entry hasn't changed.
+   If $TERM or its entry can't be found, nothing changes.  */
+static void term_detect (void)
+{
+    const char  *term = getenv ("TERM");
+    const char  *colorterm = getenv ("COLORTERM");
+    char        name [80], key [CACHE_MAX], val [CACHE_MAX], path [4096];
+    char        fkey [CACHE_MAX] = "";
+    long        colors = -1;
+    int         italic_p = 0, truecolor_p = 0, ix;
+
+    if (term == NULL || term [0] == 0 || strchr (term, '/') != NULL)
+        return;
+
+    snprintf (name, sizeof (name), "term-%.64s", term);
+    for (ix = 5; name [ix]; ++ix)           /* Keep the cache file name tame  */
+        if (! (isalnum ((uint8_t) name [ix]) || name [ix] == '-' || name [ix] == '.' || name [ix] == '_' || name [ix] == '+'))
+            name [ix] = '_';
+    const char  *tinfo = getenv ("TERMINFO"), *tdirs = getenv ("TERMINFO_DIRS"), *home = getenv ("HOME");
+    snprintf (key, sizeof (key), "TERM=%s\nTERMINFO=%s\nTERMINFO_DIRS=%s\nHOME=%s\n", term,
+              (tinfo) ? tinfo : "", (tdirs) ? tdirs : "", (home) ? home : "");
+
+    /* Cached value is "COLORS ITALIC TRUECOLOR\nPATH\nPATH-KEY".  If there's
+       no entry for TERM, that's remembered too, as colors -1 with no PATH
+       and terminfo_dirs_key () as PATH-KEY, so installing one later is seen.  */
+    char *pp, *fp;
+    int  stale_p = 1;
+    if (cache_load (name, key, val, sizeof (val))
+        && sscanf (val, "%ld %d %d", &colors, &italic_p, &truecolor_p) == 3
+        && (pp = strchr (val, '\n')) != NULL && (fp = strchr (++pp, '\n')) != NULL)
+    {
+        *fp++ = 0;
+        stale_p = (! ((pp [0]) ? cache_key_file (fkey, sizeof (fkey), pp) : terminfo_dirs_key (fkey, sizeof (fkey), term))
+                   || strcmp (fkey, fp) != 0);  /* Entry has changed?  */
+        if (! stale_p && pp [0] == 0)
+            return;                         /* Still no entry  */
+    }
+
+    if (stale_p)                            /* Not cached (or stale) - go read the terminfo entry  */
+    {
+        struct stat st;
+        void        *addr;
+        int         fd, ok = 0;
+
+        if (! terminfo_find (term, path, sizeof (path)))
+        {
+            fkey [0] = 0;
+            if (terminfo_dirs_key (fkey, sizeof (fkey), term)
+                && snprintf (val, sizeof (val), "-1 0 0\n\n%s", fkey) < (int) sizeof (val))
+                cache_store (name, key, val);
+            return;
+        }
+        if ((fd = open (path, O_RDONLY)) < 0)
+            return;
+        if (fstat (fd, &st) == 0 && st.st_size > 0
+            && (addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+        {
+            ok = (terminfo_parse (addr, st.st_size, &colors, &italic_p, &truecolor_p) == 0);
+            munmap (addr, st.st_size);
+        }
+        close (fd);
+        if (! ok)
+            return;
+
+        fkey [0] = 0;
+        if (cache_key_file (fkey, sizeof (fkey), path)
+            && snprintf (val, sizeof (val), "%ld %d %d\n%s\n%s", colors, italic_p, truecolor_p, path, fkey) < (int) sizeof (val))
+            cache_store (name, key, val);
+    }
+
+    /* Terminals often claim fewer colors than they have: trust COLORTERM too  */
+    if (colorterm != NULL && (strcmp (colorterm, "truecolor") == 0 || strcmp (colorterm, "24bit") == 0))
+        truecolor_p = 1;
+
+    term_colors = (truecolor_p || colors >= 256) ? 256 : (colors >= 16) ? 16 : (colors >= 8) ? 8 : 0;
+    if (! italic_p)
+        term_faces &= ~ FACE_ITALIC;
+}
+
+/* How we come to be running, as far as the prompt cares - see session_context ()  */
+#define SESS_SSH        1               /* Logged in over ssh, however many sudo/su/tmux later  */
+#define SESS_CONTAINER  2               /* Inside a container - see session_container  */
+#define SESS_CHROOT     4               /* chroot'd  */
+static char session_container [64];     /* Container type if SESS_CONTAINER, eg "docker"  */
+
+/* Get the command name, parent and (if START is non-NULL) start time of
+   process PID from /proc/PID/stat  */
+static int proc_stat (long pid, char *comm, size_t commsize, long *ppid, unsigned long long *start)
+{
+    char    path [64], buf [512];
+    unsigned long long dummy;
+    ssize_t n;
+    int     fd;
+
+    snprintf (path, sizeof (path), "/proc/%ld/stat", pid);
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return -1;
+    n = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (n <= 0)
+        return -1;
+    buf [n] = 0;
+
+    /* "PID (COMM) STATE PPID ..." - COMM may itself contain ") ".
+       The start time is field 22.  */
+    char *lp = strchr (buf, '('), *rp = strrchr (buf, ')');
+    if (lp == NULL || rp == NULL || rp < lp
+        || sscanf (rp + 1, " %*c %ld %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                   ppid, (start) ? start : &dummy) != 2)
+        return -1;
+    snprintf (comm, commsize, "%.*s", (int) (rp - lp - 1), lp + 1);
+    return 0;
+}
+
+/* Read the null-separated arguments of process PID into BUF.  Always
+   leaves BUF null-terminated, returns the number of bytes read.  */
+static size_t proc_cmdline (long pid, char *buf, size_t size)
+{
+    char    path [64];
+    ssize_t n = -1;
+    int     fd;
+
+    snprintf (path, sizeof (path), "/proc/%ld/cmdline", pid);
+    if ((fd = open (path, O_RDONLY)) >= 0)
+    {
+        n = read (fd, buf, size - 1);
+        close (fd);
+    }
+    buf [(n > 0) ? n : 0] = 0;
+    return (n > 0) ? n : 0;
+}
+
+static int sshd_comm_p (const char *comm)
+{
+    return (strcmp (comm, "sshd") == 0 || strbegins_p (comm, "sshd-") || strcmp (comm, "dropbear") == 0);
+}
+
+/* screen's server and clients both have the command name "screen", but
+   the server rewrites its argv [0] as "SCREEN".  */
+static int screen_server_p (long pid)
+{
+    char cmd [64];
+    proc_cmdline (pid, cmd, sizeof (cmd));
+    return strbegins_p (cmd, "SCREEN");
+}
+
+/* Is there an ssh daemon among the ancestors of PID?  If we pass through a
+   tmux or screen server on the way, "tmux" or "screen" is left in MUX and
+   the server's pid in *MUXPID.  */
+static int ssh_ancestor_p (long pid, char *mux, size_t muxsize, long *muxpid)
+{
+    char    comm [64];
+    long    ppid;
+    int     depth;
+
+    for (depth = 0; pid > 1 && depth < 128; ++depth, pid = ppid)
+    {
+        if (proc_stat (pid, comm, sizeof (comm), &ppid, NULL) != 0)
+            break;
+        if (sshd_comm_p (comm))
+            return 1;
+        if (mux != NULL && strcmp (comm, "tmux: server") == 0)
+            snprintf (mux, muxsize, "tmux"), *muxpid = pid;
+        else
+        if (mux != NULL && strcmp (comm, "screen") == 0 && screen_server_p (pid))
+            snprintf (mux, muxsize, "screen"), *muxpid = pid;
+    }
+    return 0;
+}
+
+/* The socket a tmux client with arguments CMD (LEN bytes) talks to: its
+   -S PATH, or -L NAME (else "default") in DIR, the socket directory.  */
+static void tmux_client_socket (const char *cmd, size_t len, const char *dir, char *sock, size_t socksize)
+{
+    const char  *const end = cmd + len;
+    const char  *arg = cmd + strlen (cmd) + 1;      /* Skip argv [0]  */
+    const char  *name = "default", *path = NULL;
+
+    while (arg < end && arg [0] == '-' && arg [1] && strcmp (arg, "--") != 0)
+    {
+        const char *next = arg + strlen (arg) + 1, *fp;
+
+        for (fp = arg + 1; *fp; ++fp)
+            if (strchr ("cfLST", *fp) != NULL)      /* Flags taking a value, as -Lname or -L name  */
+            {
+                const char *value = (fp [1]) ? fp + 1 : (next < end) ? next : "";
+                if (*fp == 'L') name = value;
+                if (*fp == 'S') path = value;       /* -S beats -L  */
+                if (fp [1] == 0 && next < end)
+                    next += strlen (next) + 1;
+                break;
+            }
+        arg = next;
+    }
+    if (path != NULL)
+        snprintf (sock, socksize, "%s", path);
+    else
+        snprintf (sock, socksize, "%s/%s", dir, name);
+}
+
+/* Find the socket of our MUX server, process MUXPID, for tmux from $TMUX
+   or else the server's own arguments, for screen from $STY.  Returns 0 if
+   it can't be found.  */
+static int mux_socket (const char *mux, long muxpid, char *sock, size_t socksize)
+{
+    const char  *tmux = getenv ("TMUX"), *sty = getenv ("STY");     /* "SOCKET,PID,SESSION", "PID.TTY.HOST"  */
+    const char  *tmpdir = getenv ("TMUX_TMPDIR"), *user = getenv ("USER");
+    static const char *const screen_dirs [] = {"/run/screen/S-%s", "/var/run/screen/S-%s",
+                                               "/tmp/screens/S-%s", "/tmp/uscreens/S-%s", NULL};
+    char        path [64], dir [1024], cmd [4096];
+    struct stat st;
+    int         ix;
+
+    if (strcmp (mux, "tmux") == 0)
+    {
+        if (tmux != NULL && tmux [0] == '/')
+            snprintf (sock, socksize, "%.*s", (int) strcspn (tmux, ","), tmux);
+        else
+        {
+            snprintf (path, sizeof (path), "/proc/%ld", muxpid);
+            if (stat (path, &st) != 0)
+                return 0;
+            snprintf (dir, sizeof (dir), "%s/tmux-%u", (tmpdir != NULL && tmpdir [0]) ? tmpdir : "/tmp", (unsigned) st.st_uid);
+            tmux_client_socket (cmd, proc_cmdline (muxpid, cmd, sizeof (cmd)), dir, sock, socksize);
+        }
+        return 1;
+    }
+
+    if (sty == NULL || sty [0] == 0 || strchr (sty, '/') != NULL)
+        return 0;
+    if ((tmpdir = getenv ("SCREENDIR")) != NULL && tmpdir [0])
+    {
+        snprintf (sock, socksize, "%s/%s", tmpdir, sty);
+        return 1;
+    }
+    for (ix = 0; user != NULL && screen_dirs [ix]; ++ix)
+    {
+        snprintf (dir, sizeof (dir), screen_dirs [ix], user);
+        snprintf (sock, socksize, "%s/%s", dir, sty);
+        if (access (sock, F_OK) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* A tmux/screen server is daemonised, so its ancestry is no help.  Instead
+   see if a client of our server, attached from elsewhere, came in over ssh.
+   tmux clients are matched to our server by comparing the socket in their
+   arguments with OURSOCK.  For screen (or tmux when OURSOCK isn't known)
+   there's no telling which server a client is attached to, so any of our
+   user's clients will do.  This reads every process's stat, so the answer
+   is cached - see session_context ().  */
+static int mux_client_ssh_p (const char *mux, const char *oursock)
+{
+    const int   tmux_p = (strcmp (mux, "tmux") == 0);
+    const int   match_p = (tmux_p && oursock [0]);
+    char        dir [4096], *cp;
+    DIR         *pdir;
+    struct dirent *de;
+    int         ssh_p = 0;
+
+    snprintf (dir, sizeof (dir), "%s", oursock);
+    if ((cp = strrchr (dir, '/')) != NULL)
+        *cp = 0;
+
+    if ((pdir = opendir ("/proc")) == NULL)
+        return 0;
+    while (! ssh_p && (de = readdir (pdir)) != NULL)
+    {
+        char        path [64], comm [64], cmd [4096], sock [4096];
+        struct stat st;
+        long        pid = strtol (de->d_name, NULL, 10), ppid;
+
+        if (pid <= 1 || proc_stat (pid, comm, sizeof (comm), &ppid, NULL) != 0)
+            continue;
+        if (! ((tmux_p) ? (strcmp (comm, "tmux: client") == 0 || strcmp (comm, "tmux") == 0)
+                        : (strcmp (comm, "screen") == 0 && ! screen_server_p (pid))))
+            continue;
+        if (match_p)
+        {
+            size_t len = proc_cmdline (pid, cmd, sizeof (cmd));
+            tmux_client_socket (cmd, len, dir, sock, sizeof (sock));
+            if (strcmp (sock, oursock) != 0)
+                continue;                   /* Some other tmux server's client  */
+        }
+        else
+        {
+            snprintf (path, sizeof (path), "/proc/%ld", pid);
+            if (stat (path, &st) != 0 || st.st_uid != getuid ())
+                continue;
+        }
+        ssh_p = ssh_ancestor_p (ppid, NULL, 0, NULL);
+    }
+    closedir (pdir);
+    return ssh_p;
+}
+
+/* Container type from the usual markers, or NULL if we don't look to be in one  */
+static const char *container_type (void)
+{
+    static char cgroup [4096];
+    const char  *env = getenv ("container");    /* systemd-nspawn, podman, lxc...  */
+    static const char *const cgroup_types [] = {"kubepods", "docker", "lxc", "containerd", NULL};
+    ssize_t     n;
+    int         fd, ix;
+
+    if (env != NULL && env [0])
+        return env;
+    if (access ("/.dockerenv", F_OK) == 0)
+        return "docker";
+    if (access ("/run/.containerenv", F_OK) == 0)
+        return "podman";
+
+    if ((fd = open ("/proc/1/cgroup", O_RDONLY)) < 0)
+        return NULL;
+    n = read (fd, cgroup, sizeof (cgroup) - 1);
+    close (fd);
+    cgroup [(n > 0) ? n : 0] = 0;
+    for (ix = 0; cgroup_types [ix]; ++ix)
+        if (strstr (cgroup, cgroup_types [ix]) != NULL)
+            return (ix == 0) ? "k8s" : cgroup_types [ix];
+    return NULL;
+}
+
+/* Are we chroot'd?  If our / isn't init's /, yes.  Only root may look at
+   init's /, so otherwise we go by /proc/self/mountinfo: chroot into a
+   directory that isn't itself a mount point and no mount is visible at "/".
+   Best effort - a chroot whose root is a mount point (eg bind-mounted by
+   schroot) looks like the real thing to anyone but root.  */
+static int chroot_p (void)
+{
+    struct stat root, initroot;
+    char        line [4096], mpoint [4096];
+    FILE        *fp;
+    int         root_mount_p = 0;
+
+    if (stat ("/", &root) != 0)
+        return 0;
+    if (stat ("/proc/1/root", &initroot) == 0)
+        return (root.st_dev != initroot.st_dev || root.st_ino != initroot.st_ino);
+
+    if ((fp = fopen ("/proc/self/mountinfo", "r")) == NULL)
+        return 0;                           /* No /proc - can't tell  */
+    while (! root_mount_p && fgets (line, sizeof (line), fp) != NULL)   /* ID PARENT MAJ:MIN ROOT MOUNTPOINT ...  */
+        root_mount_p = (sscanf (line, "%*s %*s %*s %*s %4095s", mpoint) == 1 && strcmp (mpoint, "/") == 0);
+    fclose (fp);
+    return ! root_mount_p;
+}
+
+/* Session cache files are named for the session id and its leader's start
+   time (plus "-mux" for the multiplexer client part), as session ids get
+   reused.  Delete those of sessions which are no more, so they don't pile
+   up.  Only done when we write a new one.  */
+static void session_cache_prune (void)
+{
+    const char  *dir = cache_dir ();
+    DIR         *cdir;
+    struct dirent *de;
+
+    if (dir == NULL || (cdir = opendir (dir)) == NULL)
+        return;
+    while ((de = readdir (cdir)) != NULL)
+    {
+        char        comm [64], path [600];
+        long        sid, ppid;
+        unsigned long long start, nowstart;
+        int         n = 0;
+
+        if (! strbegins_p (de->d_name, "session-"))
+            continue;
+        if (sscanf (de->d_name, "session-%ld-%llu%n", &sid, &start, &n) == 2
+            && (de->d_name [n] == 0 || strcmp (de->d_name + n, "-mux") == 0)
+            && proc_stat (sid, comm, sizeof (comm), &ppid, &nowstart) == 0 && nowstart == start)
+            continue;                       /* Still live  */
+        snprintf (path, sizeof (path), "%s/%s", dir, de->d_name);
+        unlink (path);
+    }
+    closedir (cdir);
+}
+
+/* Works out (once) whether we're under ssh, in a container or a chroot.
+   SSH_CLIENT and friends get lost under sudo -i, in tmux sessions started
+   elsewhere, and in containers, so failing those we walk our process
+   ancestry looking for sshd.  That's too costly for every prompt so the
+   answer is cached per session (id and leader start time) and boot id.
+
+   Under tmux or screen, whether a client came in over ssh changes as they
+   attach and detach, so that part is cached separately, keyed on the
+   server's socket: both chmod it as the first client attaches and the last
+   detaches, changing its ctime.  A repeat prompt costs reads of the boot id,
+   the session leader's stat, a stat of the socket and two small files.  */
+static unsigned session_context (void)
+{
+    static int  known_p;
+    static unsigned sess;
+    char        key [CACHE_MAX], val [CACHE_MAX], name [80], mux [64] = "", sock [CACHE_MAX - 128] = "", comm [64];
+    const char  *ctype, *cp, *mp;
+    char        *ep;
+    const long  sid = getsid (0);
+    long        ppid, muxpid = 0;
+    unsigned long long start;
+    struct stat st;
+    ssize_t     n;
+    int         fd, keyed_p = 0, cached_p = 0, ssh_p;
+
+    if (known_p)
+        return sess;
+    known_p = 1;
+
+    if (proc_stat (sid, comm, sizeof (comm), &ppid, &start) == 0
+        && (fd = open ("/proc/sys/kernel/random/boot_id", O_RDONLY)) >= 0)
+    {
+        snprintf (name, sizeof (name), "session-%ld-%llu", sid, start);
+        n = read (fd, key, 64);
+        close (fd);
+        key [(n > 0) ? n : 0] = 0;
+        keyed_p = (n > 0);
+    }
+
+    /* The cached value is "SESS [CONTAINER]\nMUX\nSOCKET"  */
+    if (keyed_p && cache_load (name, key, val, sizeof (val))
+        && (sess = strtoul (val, &ep, 10), *ep == ' ')
+        && (cp = strchr (ep, '\n')) != NULL && (mp = strchr (cp + 1, '\n')) != NULL)
+    {
+        snprintf (session_container, sizeof (session_container), "%.*s", (int) (cp - ep - 1), ep + 1);
+        snprintf (mux, sizeof (mux), "%.*s", (int) (mp - cp - 1), cp + 1);
+        snprintf (sock, sizeof (sock), "%s", mp + 1);
+        if (strcmp (mux, "-") == 0)
+            mux [0] = 0;
+        cached_p = 1;
+    }
+
+    if (! cached_p)
+    {
+        sess = 0;
+        session_container [0] = 0;
+        if (getenv ("SSH_CLIENT") != NULL || getenv ("SSH_CONNECTION") != NULL || getenv ("SSH_TTY") != NULL
+            || ssh_ancestor_p (getppid (), mux, sizeof (mux), &muxpid))
+            sess |= SESS_SSH;
+        if (mux [0] && ! mux_socket (mux, muxpid, sock, sizeof (sock)))
+            sock [0] = 0;
+
+        if ((ctype = container_type ()) != NULL)
+        {
+            sess |= SESS_CONTAINER;
+            snprintf (session_container, sizeof (session_container), "%s", ctype);
+            for (n = 0; session_container [n]; ++n)     /* Keep it to one word  */
+                if (isspace ((uint8_t) session_container [n]))
+                    session_container [n] = '_';
+        }
+        else
+        if (chroot_p ())
+            sess |= SESS_CHROOT;
+
+        if (keyed_p)
+        {
+            session_cache_prune ();
+            snprintf (val, sizeof (val), "%u %s\n%s\n%s", sess, session_container, (mux [0]) ? mux : "-", sock);
+            cache_store (name, key, val);
+        }
+    }
+
+    if (mux [0] && ! (sess & SESS_SSH))
+    {
+        /* Without a socket to key on, there's nothing for it but to look
+           every time.  */
+        if (keyed_p && sock [0])
+        {
+            strcat (name, "-mux");
+            n = strlen (key);
+            if (stat (sock, &st) == 0)
+                snprintf (key + n, sizeof (key) - n, "%s %lld.%09ld %llu\n", sock,
+                          (long long) ST_CTIM (st).tv_sec, (long) ST_CTIM (st).tv_nsec, (unsigned long long) st.st_ino);
+            else
+                snprintf (key + n, sizeof (key) - n, "%s -\n", sock);
+        }
+        if (! (keyed_p && sock [0] && cache_load (name, key, val, sizeof (val)) && sscanf (val, "%d", &ssh_p) == 1))
+        {
+            ssh_p = mux_client_ssh_p (mux, sock);
+            if (keyed_p && sock [0])
+                cache_store (name, key, (ssh_p) ? "1" : "0");
+        }
+        if (ssh_p)
+            sess |= SESS_SSH;
+    }
+    return sess;
+}
+
+static int ssh_session_p (void) { return (session_context () & SESS_SSH) != 0; }
+
+/* Tiny indication if we're in a container or chroot  */
+static void add_container (struct segs *s, unsigned fontface)
+{
+    const unsigned sess = session_context ();
+
+    if (sess & SESS_CONTAINER)
+        append_quoted (s, session_container, CONTAINER_FG, CONTAINER_BG, fontface);
+    else
+    if (sess & SESS_CHROOT)
+        append_spaced (s, "chroot", CONTAINER_FG, CONTAINER_BG, fontface);
+}
+
+/* Project markers: files whose nearest occurrence above the working
+   directory says something about the project, eg .nvmrc.  One upward walk
+   answers all the marker options given - see project_walk ().  */
+static const struct marker_info_t {
+    const char  *option;                /* tpwl option to show it  */
+    const char  *file;                  /* File to look for  */
+    const char  *label;                 /* Shown before the marker's contents  */
+} marker_info [] = {
+    {"--python",        ".python-version",  "py"},      /* Or $VIRTUAL_ENV  */
+    {"--node",          ".nvmrc",           "node"},
+    {"--go",            "go.mod",           "go"},
+    {"--rust",          "Cargo.toml",       "rust"},
+    {"--tool-versions", ".tool-versions",   ""},
+};
+enum {N_MARKERS = sizeof (marker_info) / sizeof (marker_info [0])};
+static char marker_text [N_MARKERS][256];   /* Segment text for each marker found  */
+
+static int marker_index (const char *arg)
+{
+    int ix;
+    for (ix = 0; ix < N_MARKERS; ++ix)
+        if (strcmp (arg, marker_info [ix].option) == 0)
+            return ix;
+    return -1;
+}
+
+/* Turn the contents BUF of marker file IX into its segment text: the first
+   line (or the go directive, for go.mod), all lines of .tool-versions.  */
+static void marker_format (int ix, char *buf)
+{
+    const struct marker_info_t *mi = marker_info + ix;
+    const size_t labellen = strlen (mi->label), size = sizeof (marker_text [ix]);
+    char    *text = marker_text [ix], *line, *next, *end;
+    size_t  len = snprintf (text, size, "%s", mi->label);
+
+    if (strcmp (mi->file, "Cargo.toml") == 0)
+        return;                             /* Just being a Rust project is enough  */
+
+    for (line = buf; line != NULL && len < size; line = next)
+    {
+        if ((next = strchr (line, '\n')) != NULL)
+            *next++ = 0;
+        line [strcspn (line, "#\r")] = 0;  /* Lose comments  */
+        for (end = line + strlen (line); end > line && isspace ((uint8_t) end [-1]); )
+            *--end = 0;
+        while (isspace ((uint8_t) *line))
+            ++line;
+        if (*line == 0)
+            continue;
+
+        if (strcmp (mi->file, "go.mod") == 0)
+        {
+            if (! strbegins_p (line, "go") || ! isspace ((uint8_t) line [2]))
+                continue;                   /* Only want the 'go VERSION' directive  */
+            for (line += 2; isspace ((uint8_t) *line); ++line)
+                ;
+        }
+        len += snprintf (text + len, size - len, "%s%s", (len == 0) ? "" : (len == labellen) ? " " : ", ", line);
+        if (strcmp (mi->file, ".tool-versions") != 0)
+            break;
+    }
+}
+
+/* Read marker file IX in directory DIRFD  */
+static void marker_read (int dirfd, int ix)
+{
+    char    buf [1024];
+    ssize_t n = -1;
+    int     fd;
+
+    if ((fd = openat (dirfd, marker_info [ix].file, O_RDONLY)) >= 0)
+    {
+        n = read (fd, buf, sizeof (buf) - 1);
+        close (fd);
+    }
+    buf [(n > 0) ? n : 0] = 0;
+    marker_format (ix, buf);
+}
+
+/* Which markers a directory holds is cached, keyed on its device, inode
+   and mtime (adding or removing a file changes the latter.)  */
+struct dirmarks_t {
+    unsigned long long dev, ino;
+    long long   sec;
+    long        nsec;
+    unsigned    marks;                  /* Bit per marker_info [] entry  */
+};
+
+/* Walk up from directory START, looking in each directory for the markers
+   whose bits are in WANTED, until each has been found or we reach $HOME,
+   a mount point or /.  Everything is done relative to directory fds so
+   there are no path lookups, and only directories not seen before (or
+   changed) are probed.  Sets marker_text [] for each marker found and
+   returns a bit mask of them.  */
+static unsigned project_walk (const char *start, unsigned wanted)
+{
+    enum        {MAXDIRMARKS = CACHE_MAX / 48};
+    static const char key [] = "markers: .python-version .nvmrc go.mod Cargo.toml .tool-versions\n";
+    struct dirmarks_t dm [MAXDIRMARKS + 1];
+    char        val [CACHE_MAX], *cp;
+    struct stat st, pst, home;
+    const char  *homedir = getenv ("HOME");
+    const int   home_p = (homedir != NULL && homedir [0] && stat (homedir, &home) == 0);
+    unsigned    found = 0;
+    int         ndm = 0, changed_p = 0, fd, pfd, ix, n;
+
+    if ((fd = open (start, O_RDONLY | O_DIRECTORY)) < 0 || fstat (fd, &st) != 0)
+    {
+        if (fd >= 0) close (fd);
+        return 0;
+    }
+
+    /* Cached value is "DEV INO SEC.NSEC MARKS\n" per directory, most recent first  */
+    if (cache_load ("markers", key, val, sizeof (val)))
+        for (cp = val; ndm < MAXDIRMARKS && sscanf (cp, "%llu %llu %lld.%ld %u\n%n", &dm [ndm].dev, &dm [ndm].ino,
+                                                     &dm [ndm].sec, &dm [ndm].nsec, &dm [ndm].marks, &n) == 5; cp += n)
+            ++ndm;
+
+    for (;;)
+    {
+        unsigned marks = 0;
+
+        for (ix = 0; ix < ndm; ++ix)
+            if (dm [ix].dev == (unsigned long long) st.st_dev && dm [ix].ino == (unsigned long long) st.st_ino
+                && dm [ix].sec == (long long) ST_MTIM (st).tv_sec && dm [ix].nsec == (long) ST_MTIM (st).tv_nsec)
+                break;
+        if (ix < ndm)                       /* Seen it before, unchanged  */
+            marks = dm [ix].marks;
+        else                                /* Probe for all markers, remember the answer  */
+        {
+            for (ix = 0; ix < N_MARKERS; ++ix)
+                if (faccessat (fd, marker_info [ix].file, F_OK, 0) == 0)
+                    marks |= 1u << ix;
+            memmove (dm + 1, dm, (ndm - (ndm == MAXDIRMARKS)) * sizeof (*dm));
+            ndm += (ndm < MAXDIRMARKS);
+            dm [0].dev = st.st_dev;
+            dm [0].ino = st.st_ino;
+            dm [0].sec = ST_MTIM (st).tv_sec;
+            dm [0].nsec = ST_MTIM (st).tv_nsec;
+            dm [0].marks = marks;
+            changed_p = 1;
+        }
+
+        for (ix = 0; ix < N_MARKERS; ++ix)  /* Nearest marker wins  */
+            if (marks & wanted & ~found & (1u << ix))
+            {
+                marker_read (fd, ix);
+                found |= 1u << ix;
+            }
+
+        if ((wanted & ~found) == 0 || (home_p && st.st_dev == home.st_dev && st.st_ino == home.st_ino))
+            break;
+        if ((pfd = openat (fd, "..", O_RDONLY | O_DIRECTORY)) < 0 || fstat (pfd, &pst) != 0)
+            break;
+        if (pst.st_dev != st.st_dev || pst.st_ino == st.st_ino)     /* Mount point, or /  */
+        {
+            close (pfd);
+            break;
+        }
+        close (fd);
+        fd = pfd;
+        st = pst;
+    }
+    close (fd);
+
+    if (changed_p)
+    {
+        size_t len = 0;
+        for (ix = 0; ix < ndm && len < sizeof (val) - 64; ++ix)
+            len += snprintf (val + len, sizeof (val) - len, "%llu %llu %lld.%ld %u\n",
+                             dm [ix].dev, dm [ix].ino, dm [ix].sec, dm [ix].nsec, dm [ix].marks);
+        cache_store ("markers", key, val);
+    }
+    return found;
+}
+
+/* Python virtualenv name: the venv's dir name, or its parent's if it's
+   just called venv or .venv  */
+static int python_venv (void)
+{
+    const char  *venv = getenv ("VIRTUAL_ENV");
+    const char  *base, *end;
+
+    if (venv == NULL || venv [0] == 0)
+        return 0;
+    for (end = venv + strlen (venv); ; end = base)
+    {
+        while (end > venv + 1 && end [-1] == '/')
+            --end;
+        for (base = end; base > venv && base [-1] != '/'; --base)
+            ;
+        if (base <= venv + 1 || ! ((end - base == 4 && strncmp (base, "venv", 4) == 0)
+                                   || (end - base == 5 && strncmp (base, ".venv", 5) == 0)))
+            break;
+    }
+    snprintf (marker_text [0], sizeof (marker_text [0]), "%s %.*s", marker_info [0].label, (int) (end - base), base);
+    return 1;
+}
+
+/* Add a segment for marker IX if it was found.  The walk is done the first
+   time through, for every marker option in ARGV at once; it starts from
+   the directory given by the last --pwd[=PATH] in ARGV, or $PWD.  */
+static void add_marker (struct segs *s, int ix, int argc, const char *argv [], unsigned fontface)
+{
+    static int      walked_p;
+    static unsigned found;
+
+    if (! walked_p)
+    {
+        const char  *start = getenv ("PWD");
+        unsigned    wanted = 0;
+        int         ax, mx;
+
+        walked_p = 1;
+        if (python_venv ())                 /* An active venv trumps .python-version  */
+            found |= 1u << 0;
+        for (ax = 1; ax < argc; ++ax)
+        {
+            if ((mx = marker_index (argv [ax])) >= 0)
+                wanted |= 1u << mx;
+            else
+            if (strbegins_p (argv [ax], "--pwd="))
+                start = argv [ax] + 6;
+        }
+        if ((wanted & ~found) != 0)
+            found |= project_walk ((start != NULL && start [0]) ? start : ".", wanted & ~found);
+    }
+    if (found & (1u << ix))
+        append_quoted (s, marker_text [ix], PROJECT_FG, PROJECT_BG, fontface);
+}
+
 static int usage (int exit_code)
 {
     printf ("Usage: tpwl OPTIONS [TEXT]\n");
@@ -598,6 +2041,8 @@ static int usage (int exit_code)
             "                        (if negative, only last DEPTH directories shown)\n");
     printf (" --dir-size=SIZE        Directory names longer than SIZE will be truncated\n");
     printf (" --[no-]italic          Do [not] use italic mode.  Also -i/-I\n");
+    printf (" --colors=256|16|8|0    Number of colors to use, default is what $TERM's\n"
+            "                        terminfo entry says (italics only if it has them too)\n");
     printf (" --[no-]utf8-ok         Do [not] use workarounds to fixup Bash prompt length\n");
     printf (" --user[=BLAH]          Indicate user in PS1 (explicitly or bash '\\u')\n");
     printf (" --pwd[=PATH]           Indicate working dir in PS1 (implicitly '$PWD')\n");
@@ -608,6 +2053,12 @@ static int usage (int exit_code)
             "                        if XTEXT begins with '^', add at start of title instead\n");
     printf (" --ssh-[host|user|all]  Only if ssh is being used, add host/user/ both to PS1\n");
     printf (" --ssh                  Tiny indication in PS1 if ssh is being used\n");
+    printf (" --python|node|go|rust  Python venv or .python-version, .nvmrc, go.mod or\n"
+            "                        Cargo.toml of the project containing --pwd dir\n");
+    printf (" --tool-versions        Contents of the project's .tool-versions\n");
+    printf (" --container            Tiny indication in PS1 if in a container or chroot\n");
+    printf (" --kube                 Current kubectl context[:namespace] from $KUBECONFIG\n"
+            "                        or ~/.kube/config (cached, kubectl isn't run)\n");
     printf (" --home=PATH            If different from HOME env var, substitutes '~' in pwd\n"
             "                        Note: this arg should appear BEFORE '--pwd' arg\n");
     printf (" --fb=FGCOLOR:BGCOLOR   Set fore/back color indices to use for user items\n");
@@ -629,14 +2080,9 @@ static void fatal (const char *fmt_str, ...)
     printf ("%s", "\\!\\$ ");                       /* print a default prompt  */
     exit (-1);
 }
-static inline int strbegins_p (const char *str, const char *start)
-{
-    return (strncmp (str, start, strlen (start)) == 0);
-}
 
 int main (int argc, const char *argv [])
 {
-    const int   ssh_p = (getenv ("SSH_CLIENT") != 0);
     int         bad_status_p = 0;
     const char  *prompt = 0;                        /* Defaults to '\$'  */
     const char  *homedir = NULL;
@@ -648,6 +2094,7 @@ int main (int argc, const char *argv [])
     int         history_p = 0;                      /* Include bash history cmd number in PS1?  */
     unsigned    u_fg = PATH_BG, u_bg = PATH_FG;     /* Additional string foreground / background colors  */
     unsigned    fontface = FACE_NORMAL;             /* Italic or plain text  */
+    int         term_detect_p = 1;              /* Check terminfo for what $TERM can do?  */
     int         ix;
 
     const char  *no_powerline_fonts = getenv ("NO_POWERLINE_FONTS");
@@ -717,6 +2164,13 @@ int main (int argc, const char *argv [])
                 fatal ("tpwl: %s specifies illegal size %d (min 4)\n", arg, max_dir_size);
         }
         else
+        if (strbegins_p (arg, "--colors="))
+        {
+            if (sscanf (arg + 9, "%i", &term_colors) != 1 || (term_colors != 0 && term_colors != 8 && term_colors != 16 && term_colors != 256))
+                fatal ("tpwl: can't parse arg: '%s' (expected --colors=256|16|8|0)\n", arg);
+            term_detect_p = 0;
+        }
+        else
         if (strcmp (arg, "--plain") == 0) fancy_p = 0;              /* No fancy > Powerline > path > splits  */ 
         else
         if (strcmp (arg, "--patched") == 0) symtyp = SYM_PATCHED;   /* Patched Powerline fonts available  */
@@ -733,7 +2187,7 @@ int main (int argc, const char *argv [])
         else
         if (strcmp (arg, "--ssh") == 0 || strcmp (arg, "--ssh-all") == 0)  /* add whether we're ssh  */
         {
-            if (ssh_p)                                              /* Only done if SSH active  */
+            if (ssh_session_p ())                                   /* Only done if SSH active  */
             {
                 append (s, info_symbols [symtyp].network, SSH_FG, SSH_BG, fontface);
                 if (strcmp (arg, "--ssh-all") == 0)
@@ -765,12 +2219,12 @@ int main (int argc, const char *argv [])
         else
         if (strcmp (arg, "--ssh-host") == 0)
         {
-            if (ssh_p) add_host (s, NULL, fontface);    /* If we're SSH-ing, show host  */
+            if (ssh_session_p ()) add_host (s, NULL, fontface);    /* If we're SSH-ing, show host  */
         }
         else
         if (strcmp (arg, "--ssh-user") == 0)
         {
-            if (ssh_p) add_user (s, NULL, fontface);    /* If we're SSH-ing, show user  */
+            if (ssh_session_p ()) add_user (s, NULL, fontface);    /* If we're SSH-ing, show user  */
         }
         else
         if (strbegins_p (arg, "--user"))            /* Can have explicit --user=foo or just --user to use bash \\u  */
@@ -784,6 +2238,15 @@ int main (int argc, const char *argv [])
                      max_depth, max_dir_size, fancy_p, fontface);
         }
         else
+        if (marker_index (arg) >= 0)            /* --python, --node etc  */
+            add_marker (s, marker_index (arg), argc, argv, fontface);
+        else
+        if (strcmp (arg, "--container") == 0)
+            add_container (s, fontface);
+        else
+        if (strcmp (arg, "--kube") == 0)
+            add_kube (s, fontface);
+        else
         if (strbegins_p (arg, "--host"))            /* Can have explicit --host=name or just --host to use bash \\h  */
             add_host (s, (arg [6] == '=') ? arg + 7 : NULL, fontface);
         else
@@ -796,12 +2259,7 @@ int main (int argc, const char *argv [])
         if (arg [0] == '-' && arg [1] == '-')       /* No idea.  */
             fatal ("tpwl: unknown arg '%s'\n", arg);
         else                                        /* An additional user string - add it with the user colors  */
-        {
-            char buf [512];
-            if (spaced_p)
-                snprintf (buf, sizeof (buf), " %s ", arg);
-            append (s, (spaced_p) ? buf : arg, u_fg, u_bg, fontface);  /* Add arg as user text with user fg/bg  */
-        }
+            append_spaced (s, arg, u_fg, u_bg, fontface);  /* Add arg as user text with user fg/bg  */
     }
 
     if (history_p)
@@ -815,8 +2273,10 @@ int main (int argc, const char *argv [])
     else
         append (s, prompt, CMD_PASSED_FG, CMD_PASSED_BG, fontface);
 
-    printf ("%s%s", drawsegs (pline, s, title_extra, ssh_p),
-            (spaced_p || (symtyp == SYM_PATCHED_NO_SEPS || symtyp == SYM_FLAT)) ? " " : "");
+    if (term_detect_p)
+        term_detect ();
+    drawsegs (stdout, s, title_extra, title_extra != NULL && ssh_session_p ());
+    printf ("%s", (spaced_p || (symtyp == SYM_PATCHED_NO_SEPS || symtyp == SYM_FLAT)) ? " " : "");
     return 0;
 }
 